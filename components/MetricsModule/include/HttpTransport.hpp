@@ -0,0 +1,53 @@
+#pragma once
+
+#include "MetricsTransport.hpp"
+
+#include <esp_http_client.h>
+
+/**
+ * @class HttpTransport
+ * @brief Sends each payload as an HTTP POST request.
+ */
+class HttpTransport : public MetricsTransport
+{
+public:
+    /**
+     * @brief Constructs a new HttpTransport object.
+     * @param url URL the metrics are posted to. Must outlive the transport.
+     * @param contentType Content type of the payloads. Must outlive the transport.
+     */
+    HttpTransport(const char * url, const char * contentType);
+
+    esp_err_t send(const char * payload, size_t length) override;
+
+private:
+    const char * m_url;         ///< URL the metrics are posted to.
+    const char * m_contentType; ///< Content type of the payloads.
+    int64_t m_requestStartUs;   ///< Start time of the request in progress.
+
+    /**
+     * @brief Makes one POST request and reads the response.
+     * @param client HTTP client to send the request with, closed by the caller.
+     * @param payload Request body.
+     * @param length Length of the request body in bytes.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t post(esp_http_client_handle_t client, const char * payload, size_t length);
+
+    /**
+     * @brief Records the connect time of the request in progress.
+     * @param event HTTP client event, user_data points to the HttpTransport instance.
+     * @return ESP_OK.
+     */
+    static esp_err_t httpEventHandler(esp_http_client_event_t * event);
+
+    /**
+     * @brief Resolves the host of the URL when it is not in the lwIP DNS cache, which fills the cache for the request that
+     *        follows so that no extra query is made.
+     * @return Time spent resolving in microseconds, 0 if the host was cached, -1 on failure.
+     */
+    int64_t resolveHost();
+
+    HttpTransport(const HttpTransport &)             = delete;
+    HttpTransport & operator=(const HttpTransport &) = delete;
+};
@@ -1,9 +1,24 @@
 #pragma once
 
+#include "MetricsSink.hpp"
+#include "MetricsSnapshot.hpp"
+
+#include <atomic>
 #include <esp_err.h>
+#include <esp_event.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
+#define NETIF_COUNTERS_MAX 4
+
+/**
+ * @brief Called from the vTaskPreDeletionHook() defined by the module when CONFIG_M_M_STACK_SCAN_INCREMENTAL is
+ * enabled, in place of an application hook. The default definition is weak and does nothing; define this function to
+ * run your own pre-deletion code.
+ * @param pxTCB Task being deleted.
+ */
+extern "C" void metricsModuleTaskPreDeletionHook(void * pxTCB);
+
 /**
  * @class MetricsModule
  * @brief A class for collecting and sending metrics data.
@@ -13,7 +28,7 @@ class MetricsModule
 public:
     /**
      * @brief Constructs a new MetricsModule object.
-     * @param databaseUrl URL of the database to send metrics to.
+     * @param databaseUrl URL to send metrics to: an http(s):// URL, an mqtt(s):// broker URI or udp://host:port, per the transport.
      * @param deviceLocation Location of the device.
      */
     MetricsModule(const char * databaseUrl = nullptr, const char * deviceLocation = nullptr, const char * token = nullptr);
@@ -24,7 +39,16 @@ public:
     ~MetricsModule();
 
     /**
-     * @brief Starts the metrics collection and sending task.
+     * @brief Adds a destination the metrics are sent to. Must be called before start().
+     *
+     * When no sink is added, start() adds one sending to the constructor URL with the transport selected in sdkconfig.
+     * @param config Configuration of the sink.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addSink(const MetricsSinkConfig & config);
+
+    /**
+     * @brief Starts the metrics collection task and the sink tasks.
      * @return ESP_OK on success, error code otherwise.
      */
     esp_err_t start();
@@ -32,36 +56,99 @@ public:
     static void printStackTask();
 
 private:
-    char * m_metricsBuffer;          ///< Buffer for storing metrics data.
-    TaskHandle_t m_senderTaskHandle; ///< Handle for the sender task.
-    const char * m_databaseUrl;      ///< URL of the metrics database.
-    const char * m_deviceId;         ///< Device ID for metrics.
-    const char * m_deviceLocation;   ///< Location of the device.
-    const char * m_token;            ///< Token for the metrics database.
+    MetricsSnapshot * m_snapshot;                ///< Snapshot the metrics are being collected into.
+    TaskHandle_t m_senderTaskHandle;             ///< Handle for the sender task.
+    const char * m_databaseUrl;                  ///< URL of the metrics database.
+    const char * m_deviceId;                     ///< Device ID for metrics.
+    const char * m_deviceLocation;               ///< Location of the device.
+    const char * m_token;                        ///< Token for the metrics database.
+    MetricsSink * m_sinks[CONFIG_M_M_MAX_SINKS]; ///< Destinations the metrics are sent to.
+    size_t m_sinkCount;                          ///< Number of sinks in m_sinks.
+
+    /**
+     * @brief Snapshot of monotonic network counters, used to report deltas per interval.
+     */
+    struct NetworkCounters
+    {
+        uint32_t tcpRetransmits;                     ///< TCP segments retransmitted.
+        uint32_t tcpDrops;                           ///< TCP segments dropped.
+        uint32_t tcpErrors;                          ///< TCP memory, routing and protocol errors.
+        uint32_t ipDrops;                            ///< IP packets dropped.
+        uint32_t poolErrors;                         ///< Failed pbuf and memp pool allocations.
+        uint32_t wifiDisconnects;                    ///< Wi-Fi station disconnects.
+        uint32_t netifRxBytes[NETIF_COUNTERS_MAX];   ///< Received bytes per netif index.
+        uint32_t netifTxBytes[NETIF_COUNTERS_MAX];   ///< Transmitted bytes per netif index.
+        uint32_t netifRxPackets[NETIF_COUNTERS_MAX]; ///< Received packets per netif index.
+        uint32_t netifTxPackets[NETIF_COUNTERS_MAX]; ///< Transmitted packets per netif index.
+    };
+
+    NetworkCounters m_networkCounters;                ///< Counters at the end of the previous interval.
+    std::atomic<uint32_t> m_wifiDisconnects;          ///< Wi-Fi disconnects since start.
+    std::atomic<uint32_t> m_wifiLastDisconnectReason; ///< Reason code of the last Wi-Fi disconnect.
+    esp_event_handler_instance_t m_wifiEventHandler;  ///< Handler instance for Wi-Fi disconnect events.
+
+    /**
+     * @brief Counts Wi-Fi station disconnects.
+     * @param arg Pointer to the MetricsModule instance.
+     * @param eventBase Event base, always WIFI_EVENT.
+     * @param eventId Event ID, always WIFI_EVENT_STA_DISCONNECTED.
+     * @param eventData Pointer to wifi_event_sta_disconnected_t.
+     */
+    static void wifiEventHandler(void * arg, esp_event_base_t eventBase, int32_t eventId, void * eventData);
 
     /**
-     * @brief Task function for sending metrics data.
+     * @brief Cost of the metrics pipeline itself, reported with the next payload.
+     */
+    struct SelfStats
+    {
+        uint32_t taskRunTime;                       ///< Run time counter of the sender task at the previous cycle.
+        uint32_t sinkRunTime[CONFIG_M_M_MAX_SINKS]; ///< Run time counters of the sink tasks at the previous cycle.
+        int64_t taskRunTimeAtUs;                    ///< Time at which the run time counters were sampled.
+    };
+
+    SelfStats m_selfStats; ///< Self telemetry of the metrics pipeline.
+
+    /**
+     * @brief Task whose stack is checked by the incremental stack scan.
+     */
+    struct StackWatch
+    {
+        TaskHandle_t handle;                ///< Handle of the task.
+        char name[configMAX_TASK_NAME_LEN]; ///< Metric name of the task.
+        UBaseType_t highWaterMark;          ///< Last stack high water mark read for the task, unknown until first read.
+    };
+
+    StackWatch * m_stackWatches;    ///< Tasks checked by the incremental stack scan.
+    UBaseType_t m_stackWatchCount;  ///< Number of tasks in m_stackWatches.
+    UBaseType_t m_stackWatchNext;   ///< Index of the next task to check.
+    uint32_t m_stackWatchDeletions; ///< Task deletions counted when m_stackWatches was enumerated.
+    int64_t m_stackSuspendMaxUs;    ///< Longest task enumeration since the previous snapshot.
+    int64_t m_stackStepMaxUs;       ///< Longest incremental stack scan step since the previous snapshot.
+    size_t m_truncatedMetrics;      ///< Metrics left out of the previous snapshot because the buffer was full.
+
+    /**
+     * @brief Task function collecting metrics and handing them to the sinks.
      * @param pvParameters Parameters for the task.
      */
     static void senderTask(void * pvParameters);
 
     /**
-     * @brief Resets the metrics buffer.
+     * @brief Collects all metrics into m_snapshot.
+     * @param buildStartUs Time at which collecting started.
      * @return ESP_OK on success, error code otherwise.
      */
-    esp_err_t resetBuffer();
+    esp_err_t collectMetrics(int64_t buildStartUs);
 
     /**
-     * @brief Adds JSON prefix to the metrics buffer.
-     * @return ESP_OK on success, error code otherwise.
+     * @brief Waits for the next collection, checking task stacks incrementally in the meantime.
      */
-    esp_err_t addPrefixJsonToBuffer();
+    void waitForNextCycle();
 
     /**
-     * @brief Adds JSON postfix to the metrics buffer.
+     * @brief Adds the sink configured in sdkconfig, sending to m_databaseUrl.
      * @return ESP_OK on success, error code otherwise.
      */
-    esp_err_t addPostfixJsonToBuffer();
+    esp_err_t addDefaultSink();
 
     /**
      * @brief Adds a metric to the metrics buffer.
@@ -105,13 +192,79 @@ private:
     esp_err_t addTasksFreeStackToBuffer();
 
     /**
-     * @brief Sends the buffered metrics to the server.
+     * @brief Enumerates the tasks into m_stackWatches without reading their stacks, keeping the high water marks of
+     * tasks already watched. The others are unknown until read by scanStacksStep().
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t refreshStackWatches();
+
+    /**
+     * @brief Reads the stack high water mark of the next CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP tasks.
+     *
+     * Tasks are enumerated again instead when a task was created or deleted, as cached handles may be stale.
+     */
+    void scanStacksStep();
+
+    /**
+     * @brief Returns whether a task was created or deleted since m_stackWatches was enumerated.
+     */
+    bool stackWatchesStale();
+
+    /**
+     * @brief Adds lwIP, per-netif and Wi-Fi link statistics to the metrics buffer.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addNetworkStatsToBuffer();
+
+    /**
+     * @brief Adds lwIP TCP, IP and pool statistics to the metrics buffer.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addLwipStatsToBuffer();
+
+    /**
+     * @brief Adds TX/RX bytes and packets of each network interface to the metrics buffer.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addNetifStatsToBuffer();
+
+    /**
+     * @brief Adds Wi-Fi channel, PHY mode, bandwidth and disconnect counters to the metrics buffer.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addWifiLinkStatsToBuffer();
+
+    /**
+     * @brief Sets the network counters to their current values, so that the first interval only reports its own deltas.
+     */
+    void primeNetworkCounters();
+
+    /**
+     * @brief Runs a collector and, if self telemetry is enabled, adds its duration to the metrics buffer.
+     * @param name Name of the collector, used as "mm<name>Us".
+     * @param collector Collector to run.
+     * @return Result of the collector.
+     */
+    esp_err_t runCollector(const char * name, esp_err_t (MetricsModule::*collector)());
+
+    /**
+     * @brief Adds the cost of building and sending metrics to the metrics buffer.
+     * @param buildStartUs Time at which building the current payload started.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t addSelfStatsToBuffer(int64_t buildStartUs);
+
+    /**
+     * @brief Adds a metric of a sink to the metrics buffer, named "mmSink<index><name>".
+     * @param index Index of the sink.
+     * @param name Name of the metric.
+     * @param value Value of the metric.
      * @return ESP_OK on success, error code otherwise.
      */
-    esp_err_t sendBufferedMetrics();
+    esp_err_t addSinkMetricToBuffer(size_t index, const char * name, int value);
 
     /**
-     * @brief Prints the metrics buffer.
+     * @brief Prints the metrics buffer as JSON.
      * @return ESP_OK on success, error code otherwise.
      */
     esp_err_t printMetricBuffer();
@@ -123,10 +276,10 @@ private:
     bool checkNetworkConnection();
 
     /**
-     * @brief Generates a random device ID.
+     * @brief Generates the device ID from the station MAC address, or a random one if it cannot be read.
      * @return ESP_OK on success, error code otherwise.
      */
-    esp_err_t generateRandomDeviceId();
+    esp_err_t generateDeviceId();
 
     MetricsModule(const MetricsModule &)             = delete;
     MetricsModule & operator=(const MetricsModule &) = delete;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "MetricsSnapshot.hpp"
+#include "MetricsTransport.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+/**
+ * @brief Configuration of a destination the metrics are sent to.
+ */
+struct MetricsSinkConfig
+{
+    MetricsTransportType transport; ///< Transport used to send the metrics.
+    const char * url;               ///< Destination URL, interpreted by the transport.
+    MetricsFormat format;           ///< Serialization format of the payloads.
+    uint32_t periodSec;             ///< Minimum time between two snapshots taken by this sink, 0 to take every snapshot.
+    uint8_t batchSize;              ///< Number of snapshots sent together in one payload.
+    uint8_t queueLength;            ///< Number of snapshots waiting to be sent before the oldest is dropped.
+    const char * mqttTopic;         ///< Topic the metrics are published to, for the MQTT transport.
+    int mqttQos;                    ///< Quality of service of the published metrics, for the MQTT transport.
+};
+
+/**
+ * @brief Cost and outcome of a sink, beyond those of its transport.
+ */
+struct MetricsSinkStats
+{
+    int64_t serializeUs;        ///< Serialization time of the last payload.
+    uint32_t payloadBytes;      ///< Size of the last payload.
+    uint32_t drops;             ///< Snapshots dropped because the queue was full, since start.
+    uint32_t serializeFailures; ///< Payloads dropped because they could not be serialized, since start.
+};
+
+/**
+ * @class MetricsSink
+ * @brief Sends shared metrics snapshots to one destination from its own task.
+ *
+ * Snapshots are offered without blocking and queued in a bounded queue, so a slow or unreachable destination only
+ * drops its own oldest snapshots and never delays the collector or other sinks.
+ */
+class MetricsSink
+{
+public:
+    /**
+     * @brief Constructs a new MetricsSink object.
+     * @param config Configuration of the sink. Strings are copied.
+     * @param deviceId Device ID, used as MQTT client ID and in StatsD metric names. Must outlive the sink.
+     */
+    MetricsSink(const MetricsSinkConfig & config, const char * deviceId);
+
+    /**
+     * @brief Destroys the MetricsSink object, releasing the queued snapshots.
+     */
+    ~MetricsSink();
+
+    /**
+     * @brief Starts the transport and the sink task.
+     * @param index Index of the sink, used in the task name and the transport client ID.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t start(size_t index);
+
+    /**
+     * @brief Offers a snapshot to the sink without blocking.
+     *
+     * The sink takes its own reference if the snapshot is due for its period, dropping its oldest queued snapshot
+     * when the queue is full.
+     * @param snapshot Snapshot to offer.
+     */
+    void offer(MetricsSnapshot * snapshot);
+
+    /**
+     * @brief Returns a consistent copy of the statistics of the sink, safe to call from any task.
+     */
+    MetricsSinkStats stats() const;
+
+    /**
+     * @brief Returns a consistent copy of the statistics of the sink transport, safe to call from any task.
+     */
+    MetricsTransportStats transportStats() const { return m_transport->stats(); }
+
+    /**
+     * @brief Returns the handle of the sink task.
+     */
+    TaskHandle_t taskHandle() const { return m_taskHandle; }
+
+private:
+    MetricsSinkConfig m_config;       ///< Configuration, with owned string copies.
+    const char * m_deviceId;          ///< Device ID.
+    MetricsTransport * m_transport;   ///< Transport the payloads are sent with.
+    QueueHandle_t m_queue;            ///< Snapshots waiting to be sent.
+    TaskHandle_t m_taskHandle;        ///< Handle of the sink task.
+    MetricsSnapshot ** m_batch;       ///< Snapshots of the payload being built.
+    char * m_payload;                 ///< Buffer of the payload being built.
+    size_t m_payloadSize;             ///< Size of m_payload.
+    int64_t m_lastOfferUs;            ///< Time of the last snapshot taken.
+    MetricsSinkStats m_stats;         ///< Statistics of the sink, guarded by m_statsLock.
+    mutable portMUX_TYPE m_statsLock; ///< Guards m_stats, which the sender and sink tasks both update.
+
+    /**
+     * @brief Task function sending the queued snapshots.
+     * @param pvParameters Pointer to the MetricsSink instance.
+     */
+    static void sinkTask(void * pvParameters);
+
+    /**
+     * @brief Creates the transport selected in the configuration.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t createTransport();
+
+    /**
+     * @brief Serializes snapshots into m_payload.
+     * @param count Number of snapshots in m_batch.
+     * @param length Receives the length of the payload.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t serialize(size_t count, size_t * length);
+
+    MetricsSink(const MetricsSink &)             = delete;
+    MetricsSink & operator=(const MetricsSink &) = delete;
+};
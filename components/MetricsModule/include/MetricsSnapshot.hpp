@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <esp_err.h>
+#include <sdkconfig.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @class MetricsSnapshot
+ * @brief The metrics collected in one period, shared read-only by all sinks.
+ *
+ * A snapshot is filled by the collector, then handed to every sink by pointer. Each holder calls release() when done,
+ * and the last release frees the snapshot.
+ */
+class MetricsSnapshot
+{
+public:
+    /**
+     * @brief Constructs an empty snapshot with a reference count of one.
+     */
+    MetricsSnapshot();
+
+    /**
+     * @brief Takes an additional reference to the snapshot.
+     */
+    void retain();
+
+    /**
+     * @brief Drops a reference to the snapshot, deleting it when it was the last one.
+     */
+    void release();
+
+    /**
+     * @brief Adds a string metric.
+     * @param name Name of the metric.
+     * @param value Value of the metric.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the snapshot is full or its JSON would not fit in
+     * CONFIG_M_M_BUFFER_SIZE.
+     */
+    esp_err_t add(const char * name, const char * value);
+
+    /**
+     * @brief Adds an integer metric.
+     * @param name Name of the metric.
+     * @param value Value of the metric.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the snapshot is full or its JSON would not fit in
+     * CONFIG_M_M_BUFFER_SIZE.
+     */
+    esp_err_t add(const char * name, int value);
+
+    /**
+     * @brief Returns the number of metrics rejected by add() because the snapshot was full.
+     * @return Number of metrics left out of the snapshot.
+     */
+    size_t droppedCount() const;
+
+    /**
+     * @brief Serializes the snapshot as a JSON object, which always fits in CONFIG_M_M_BUFFER_SIZE bytes.
+     * @param out Buffer receiving the JSON, null terminated.
+     * @param size Size of the buffer.
+     * @param length Receives the length written, excluding the terminator.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the buffer is too small.
+     */
+    esp_err_t toJson(char * out, size_t size, size_t * length) const;
+
+    /**
+     * @brief Serializes the integer metrics of the snapshot as StatsD gauges, one "<prefix>.<deviceId>.<name>:<value>|g" line
+     * each.
+     * @param prefix Prefix of the metric names.
+     * @param deviceId Device ID placed after the prefix.
+     * @param out Buffer receiving the lines, null terminated.
+     * @param size Size of the buffer.
+     * @param length Receives the length written, excluding the terminator.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the buffer is too small.
+     */
+    esp_err_t toStatsd(const char * prefix, const char * deviceId, char * out, size_t size, size_t * length) const;
+
+private:
+    /**
+     * @brief A metric, referring to its name and string value in m_strings.
+     */
+    struct Entry
+    {
+        uint16_t nameOffset;  ///< Offset of the name in m_strings.
+        uint16_t valueOffset; ///< Offset of the string value in m_strings, UINT16_MAX for integer metrics.
+        int32_t value;        ///< Value of integer metrics.
+    };
+
+    std::atomic<int> m_refCount;             ///< Number of holders of the snapshot.
+    size_t m_entryCount;                     ///< Number of metrics in m_entries.
+    size_t m_stringsUsed;                    ///< Bytes used in m_strings.
+    size_t m_jsonLength;                     ///< Length of the snapshot serialized as JSON, excluding the terminator.
+    size_t m_droppedCount;                   ///< Number of metrics rejected because the snapshot was full.
+    Entry m_entries[CONFIG_M_M_MAX_METRICS]; ///< Metrics in the order they were added.
+    char m_strings[CONFIG_M_M_BUFFER_SIZE];  ///< Names and string values, null terminated.
+
+    /**
+     * @brief Copies a string into m_strings.
+     * @param str String to copy.
+     * @param offset Receives the offset of the copy.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if m_strings is full.
+     */
+    esp_err_t addString(const char * str, uint16_t * offset);
+
+    /**
+     * @brief Returns the JSON length of the snapshot once a metric is added.
+     * @param entryLength JSON length of the metric, without the separating comma.
+     * @return The new JSON length, excluding the terminator.
+     */
+    size_t jsonLengthWith(size_t entryLength) const;
+
+    MetricsSnapshot(const MetricsSnapshot &)             = delete;
+    MetricsSnapshot & operator=(const MetricsSnapshot &) = delete;
+};
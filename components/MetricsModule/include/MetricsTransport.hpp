@@ -0,0 +1,90 @@
+#pragma once
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Serialization format of a metrics payload.
+ */
+enum MetricsFormat
+{
+    METRICS_FORMAT_JSON,   ///< A JSON object, or an array of objects for a batch.
+    METRICS_FORMAT_STATSD, ///< StatsD gauges, one "name:value|g" line per metric.
+};
+
+/**
+ * @brief Transport a sink sends its payloads with.
+ */
+enum MetricsTransportType
+{
+    METRICS_TRANSPORT_HTTP, ///< HTTP POST request per payload.
+    METRICS_TRANSPORT_MQTT, ///< Publish over a persistent MQTT session.
+    METRICS_TRANSPORT_UDP,  ///< Fire-and-forget UDP datagram per payload.
+};
+
+/**
+ * @brief Cost and outcome of the sends made by a transport.
+ */
+struct MetricsTransportStats
+{
+    int64_t dnsUs;         ///< DNS resolution time of the last send, 0 if the host was cached, -1 if it failed.
+    int64_t connectUs;     ///< TCP connect and TLS handshake time of the last (re)connect.
+    int64_t ttfbUs;        ///< Time from request body sent to response headers received of the last send.
+    int64_t sendUs;        ///< Total time of the last send, including retries.
+    uint32_t sendFailures; ///< Sends that failed after all retries, since start.
+    uint32_t sendRetries;  ///< Send attempts that were retried, since start.
+};
+
+/**
+ * @class MetricsTransport
+ * @brief Interface for delivering serialized metrics to a destination.
+ */
+class MetricsTransport
+{
+public:
+    virtual ~MetricsTransport() = default;
+
+    /**
+     * @brief Prepares the transport, e.g. opens a persistent session.
+     * @param clientId Identifier of this device, used where the protocol needs one.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    virtual esp_err_t start(const char * clientId) { return ESP_OK; }
+
+    /**
+     * @brief Sends a serialized payload.
+     * @param payload Payload to send.
+     * @param length Length of the payload in bytes.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    virtual esp_err_t send(const char * payload, size_t length) = 0;
+
+    /**
+     * @brief Returns a consistent copy of the statistics last published, safe to call from any task.
+     */
+    MetricsTransportStats stats() const;
+
+    /**
+     * @brief Publishes the statistics updated by the sends made so far. Called by the sending task after each send.
+     */
+    void publishStats();
+
+protected:
+    MetricsTransportStats m_stats = {};                              ///< Statistics updated by the sending task.
+    mutable portMUX_TYPE m_statsLock = portMUX_INITIALIZER_UNLOCKED; ///< Guards m_published, and m_stats from other tasks.
+
+    /**
+     * @brief Extracts the host and port from a URL of the form "scheme://host[:port][/path]".
+     * @param url URL to parse.
+     * @param host Buffer receiving the host name.
+     * @param hostSize Size of the host buffer.
+     * @param port Receives the port, left untouched if the URL has none.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the URL cannot be parsed.
+     */
+    static esp_err_t parseUrl(const char * url, char * host, size_t hostSize, uint16_t * port);
+
+private:
+    MetricsTransportStats m_published = {}; ///< Copy of m_stats read by other tasks.
+};
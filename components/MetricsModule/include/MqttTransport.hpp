@@ -0,0 +1,56 @@
+#pragma once
+
+#include "MetricsTransport.hpp"
+
+#include <atomic>
+#include <esp_event.h>
+#include <mqtt_client.h>
+
+/**
+ * @class MqttTransport
+ * @brief Publishes each payload to an MQTT topic over a persistent session.
+ *
+ * The session is opened once by start() and kept alive by the MQTT client, so a send is a single PUBLISH packet.
+ */
+class MqttTransport : public MetricsTransport
+{
+public:
+    /**
+     * @brief Constructs a new MqttTransport object.
+     * @param brokerUri URI of the broker, e.g. "mqtt://192.168.1.10:1883". Must outlive the transport.
+     * @param topic Topic the metrics are published to. Must outlive the transport.
+     * @param qos Quality of service of the published messages, 0 to 2.
+     * @param outboxLimit Size limit in bytes of the messages kept in the client outbox until delivered.
+     */
+    MqttTransport(const char * brokerUri, const char * topic, int qos, size_t outboxLimit);
+
+    /**
+     * @brief Destroys the MqttTransport object and closes the session.
+     */
+    ~MqttTransport() override;
+
+    esp_err_t start(const char * clientId) override;
+
+    esp_err_t send(const char * payload, size_t length) override;
+
+private:
+    const char * m_brokerUri;          ///< URI of the broker.
+    const char * m_topic;              ///< Topic the metrics are published to.
+    int m_qos;                         ///< Quality of service of the published messages.
+    size_t m_outboxLimit;              ///< Size limit in bytes of the client outbox.
+    esp_mqtt_client_handle_t m_client; ///< Handle of the MQTT client.
+    std::atomic<bool> m_connected;     ///< Whether the session is currently connected.
+    int64_t m_connectStartUs;          ///< Start time of the connection attempt in progress.
+
+    /**
+     * @brief Tracks the connection state of the session.
+     * @param arg Pointer to the MqttTransport instance.
+     * @param eventBase Event base of the MQTT client.
+     * @param eventId MQTT event ID.
+     * @param eventData Pointer to esp_mqtt_event_t.
+     */
+    static void mqttEventHandler(void * arg, esp_event_base_t eventBase, int32_t eventId, void * eventData);
+
+    MqttTransport(const MqttTransport &)             = delete;
+    MqttTransport & operator=(const MqttTransport &) = delete;
+};
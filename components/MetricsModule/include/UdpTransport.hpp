@@ -0,0 +1,46 @@
+#pragma once
+
+#include "MetricsTransport.hpp"
+
+#include <lwip/sockets.h>
+
+/**
+ * @class UdpTransport
+ * @brief Sends each payload as fire-and-forget UDP datagrams, e.g. of StatsD gauges, split on line boundaries.
+ */
+class UdpTransport : public MetricsTransport
+{
+public:
+    /**
+     * @brief Constructs a new UdpTransport object.
+     * @param url Destination of the form "udp://host[:port]", the port defaults to 8125. Must outlive the transport.
+     */
+    explicit UdpTransport(const char * url);
+
+    /**
+     * @brief Destroys the UdpTransport object and closes the socket.
+     */
+    ~UdpTransport() override;
+
+    esp_err_t send(const char * payload, size_t length) override;
+
+private:
+    const char * m_url;                    ///< Destination URL.
+    int m_socket;                          ///< UDP socket, -1 until the destination is resolved.
+    struct sockaddr_storage m_destination; ///< Resolved destination address.
+    socklen_t m_destinationLength;         ///< Length of the resolved destination address.
+
+    /**
+     * @brief Resolves the destination and opens the socket.
+     * @return ESP_OK on success, error code otherwise.
+     */
+    esp_err_t openSocket();
+
+    /**
+     * @brief Closes the socket so that the destination is resolved again on the next send.
+     */
+    void closeSocket();
+
+    UdpTransport(const UdpTransport &)             = delete;
+    UdpTransport & operator=(const UdpTransport &) = delete;
+};
@@ -0,0 +1,160 @@
+#include "HttpTransport.hpp"
+
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <lwip/dns.h>
+#include <lwip/netdb.h>
+
+static const char * TAG = "HttpTransport";
+
+/**
+ * @brief Host name checked against the lwIP DNS cache in the TCP/IP task.
+ */
+struct DnsCacheCheck
+{
+    const char * host; ///< Host name to look up.
+    bool needsLookup;  ///< Set when the host was not cached and a query has been started.
+};
+
+static void dnsFoundIgnored(const char *, const ip_addr_t *, void *) {}
+
+static esp_err_t checkDnsCache(void * ctx)
+{
+    DnsCacheCheck * check = (DnsCacheCheck *) ctx;
+    ip_addr_t addr;
+    // Answers from the cache, or starts the query that the lookups that follow wait for
+    check->needsLookup = dns_gethostbyname(check->host, &addr, &dnsFoundIgnored, nullptr) == ERR_INPROGRESS;
+    return ESP_OK;
+}
+
+HttpTransport::HttpTransport(const char * url, const char * contentType) :
+    m_url(url), m_contentType(contentType), m_requestStartUs(0)
+{}
+
+esp_err_t HttpTransport::send(const char * payload, size_t length)
+{
+    int64_t sendStartUs = esp_timer_get_time();
+#if CONFIG_M_M_SELF_STATS
+    m_stats.dnsUs = resolveHost();
+#endif
+
+    esp_http_client_config_t config = {
+        .url           = m_url,
+        .method        = HTTP_METHOD_POST,
+        .timeout_ms    = CONFIG_M_M_HTTP_TIMEOUT_MS,
+        .event_handler = &HttpTransport::httpEventHandler,
+        .user_data     = this,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to initialize HTTP client");
+        m_stats.sendFailures++;
+        return ESP_FAIL;
+    }
+    esp_err_t err;
+    err = esp_http_client_set_header(client, "Content-Type", m_contentType);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set HTTP header: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        m_stats.sendFailures++;
+        return err;
+    }
+    for (int attempt = 0; attempt <= CONFIG_M_M_HTTP_RETRIES; attempt++)
+    {
+        if (attempt > 0)
+        {
+            ESP_LOGW(TAG, "Retrying HTTP request (%d/%d)", attempt, CONFIG_M_M_HTTP_RETRIES);
+            m_stats.sendRetries++;
+        }
+        m_stats.connectUs = 0;
+        m_stats.ttfbUs    = 0;
+        m_requestStartUs  = esp_timer_get_time();
+        err               = post(client, payload, length);
+        esp_http_client_close(client);
+        if (err == ESP_OK)
+        {
+            break;
+        }
+        ESP_LOGE(TAG, "Failed to perform HTTP request: %s", esp_err_to_name(err));
+    }
+    esp_http_client_cleanup(client);
+
+    if (err != ESP_OK)
+    {
+        m_stats.sendFailures++;
+    }
+    m_stats.sendUs = esp_timer_get_time() - sendStartUs;
+    return err;
+}
+
+esp_err_t HttpTransport::post(esp_http_client_handle_t client, const char * payload, size_t length)
+{
+    esp_err_t err = esp_http_client_open(client, length);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    int written = esp_http_client_write(client, payload, length);
+    if (written < 0 || (size_t) written != length)
+    {
+        return ESP_FAIL;
+    }
+    int64_t bodySentUs = esp_timer_get_time();
+    if (esp_http_client_fetch_headers(client) < 0)
+    {
+        return ESP_FAIL;
+    }
+    m_stats.ttfbUs = esp_timer_get_time() - bodySentUs;
+    return esp_http_client_flush_response(client, nullptr);
+}
+
+esp_err_t HttpTransport::httpEventHandler(esp_http_client_event_t * event)
+{
+    HttpTransport * self = (HttpTransport *) event->user_data;
+
+    if (event->event_id == HTTP_EVENT_ON_CONNECTED)
+    {
+        self->m_stats.connectUs = esp_timer_get_time() - self->m_requestStartUs;
+    }
+    return ESP_OK;
+}
+
+int64_t HttpTransport::resolveHost()
+{
+    char host[64];
+    uint16_t port = 0;
+    if (parseUrl(m_url, host, sizeof(host), &port) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to parse host from URL: %s", m_url);
+        return -1;
+    }
+
+    DnsCacheCheck check = { .host = host, .needsLookup = false };
+    int64_t startUs     = esp_timer_get_time();
+    if (esp_netif_tcpip_exec(&checkDnsCache, &check) != ESP_OK)
+    {
+        return -1;
+    }
+    if (!check.needsLookup)
+    {
+        return 0;
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family       = AF_UNSPEC;
+    hints.ai_socktype     = SOCK_STREAM;
+    struct addrinfo * res = nullptr;
+
+    int err           = getaddrinfo(host, nullptr, &hints, &res);
+    int64_t elapsedUs = esp_timer_get_time() - startUs;
+    if (err != 0 || res == nullptr)
+    {
+        ESP_LOGW(TAG, "Failed to resolve host: %s", host);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return elapsedUs;
+}
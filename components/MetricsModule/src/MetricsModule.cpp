@@ -1,17 +1,240 @@
 #include "MetricsModule.hpp"
+#include "MetricsTaskConfig.hpp"
 
-#include <esp_http_client.h>
 #include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_netif.h>
 #include <esp_random.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+#include <esp_private/freertos_debug.h>
+#endif
+#include <lwip/memp.h>
+#include <lwip/netif.h>
+#include <lwip/stats.h>
+#include <new>
 
 static const char * TAG = "MetricsModule";
-#define DEVICEID_SIZE 5
+#define DEVICEID_SIZE 12
+#define HIGH_WATER_MARK_UNKNOWN ((UBaseType_t) -1)
+
+/**
+ * @brief Returns the increase of a wrapping counter since the previous call and stores the current value.
+ * @param current Current value of the counter, in its native width.
+ * @param previous Value at the previous call, updated to the current value.
+ * @return Increase of the counter.
+ */
+template <typename T>
+static int counterDelta(T current, uint32_t & previous)
+{
+    T delta  = (T) (current - (T) previous);
+    previous = current;
+    return (int) delta;
+}
+
+/**
+ * @brief Builds the metric name of a task, numbering the idle tasks of each core.
+ * @param taskName Name of the task.
+ * @param taskNumber Number of the task.
+ * @param name Buffer receiving the metric name.
+ * @param size Size of the name buffer.
+ */
+static void taskMetricName(const char * taskName, UBaseType_t taskNumber, char * name, size_t size)
+{
+    if (strcmp(taskName, "IDLE") == 0)
+    {
+        snprintf(name, size, "IDLE_%d", (int) taskNumber);
+    }
+    else
+    {
+        snprintf(name, size, "%s", taskName);
+    }
+}
+
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+static portMUX_TYPE s_stackScanLock = portMUX_INITIALIZER_UNLOCKED; ///< Held while cached task handles are read.
+static uint32_t s_taskDeletions     = 0;                            ///< Tasks deleted since boot, under s_stackScanLock.
+
+/**
+ * @brief Called by FreeRTOS right before the memory of a deleted task is freed.
+ *
+ * Taking the scan lock waits for a stack scan step in progress, so no task is freed while its cached handle is read,
+ * and the deletion count tells later steps that the cached handles may be stale.
+ * @param pxTCB Task being deleted.
+ */
+extern "C" void vTaskPreDeletionHook(void * pxTCB)
+{
+    portENTER_CRITICAL(&s_stackScanLock);
+    s_taskDeletions++;
+    portEXIT_CRITICAL(&s_stackScanLock);
+    metricsModuleTaskPreDeletionHook(pxTCB);
+}
+
+extern "C" void __attribute__((weak)) metricsModuleTaskPreDeletionHook(void *) {}
+
+/**
+ * @brief Returns the number of tasks deleted since boot.
+ */
+static uint32_t taskDeletions()
+{
+    portENTER_CRITICAL(&s_stackScanLock);
+    uint32_t deletions = s_taskDeletions;
+    portEXIT_CRITICAL(&s_stackScanLock);
+    return deletions;
+}
+#endif
+
+#if CONFIG_M_M_NETWORK_STATS
+/**
+ * @brief lwIP pools reported by their usage, high water mark and failed allocations.
+ */
+static const struct
+{
+    const char * name;
+    memp_t pool;
+} s_lwipPools[] = {
+    { "pbufPool", MEMP_PBUF_POOL }, { "pbuf", MEMP_PBUF },      { "tcpPcb", MEMP_TCP_PCB },
+    { "tcpSeg", MEMP_TCP_SEG },     { "udpPcb", MEMP_UDP_PCB }, { "sockets", MEMP_NETCONN },
+};
+
+/**
+ * @brief Returns the TCP memory, routing and protocol errors counted by lwIP.
+ */
+static STAT_COUNTER lwipTcpErrors()
+{
+    return (STAT_COUNTER) (lwip_stats.tcp.chkerr + lwip_stats.tcp.memerr + lwip_stats.tcp.rterr + lwip_stats.tcp.proterr +
+                           lwip_stats.tcp.err);
+}
+
+/**
+ * @brief Returns the failed allocations of the reported lwIP pools.
+ */
+static STAT_COUNTER lwipPoolErrors()
+{
+    STAT_COUNTER poolErrors = 0;
+    for (const auto & pool : s_lwipPools)
+    {
+        if (lwip_stats.memp[pool.pool] != nullptr)
+        {
+            poolErrors += lwip_stats.memp[pool.pool]->err;
+        }
+    }
+    return poolErrors;
+}
+
+/**
+ * @brief Traffic counters of one lwIP netif and the driver callbacks they wrap.
+ *
+ * lwIP only updates the per-netif MIB2 counters from the netif driver, which the Wi-Fi glue does not do,
+ * so the input and linkoutput callbacks are wrapped to count bytes and packets.
+ */
+struct NetifTraffic
+{
+    std::atomic<bool> hooked;
+    char name[2];
+    std::atomic<netif_input_fn> input;
+    std::atomic<netif_linkoutput_fn> linkoutput;
+    volatile uint32_t rxBytes;
+    volatile uint32_t txBytes;
+    volatile uint32_t rxPackets;
+    volatile uint32_t txPackets;
+};
+
+static NetifTraffic s_netifTraffic[NETIF_COUNTERS_MAX];
+
+static err_t countingNetifInput(struct pbuf * p, struct netif * netif)
+{
+    NetifTraffic & traffic = s_netifTraffic[netif->num];
+    traffic.rxBytes += p->tot_len;
+    traffic.rxPackets++;
+    return traffic.input.load(std::memory_order_acquire)(p, netif);
+}
+
+static err_t countingNetifLinkoutput(struct netif * netif, struct pbuf * p)
+{
+    NetifTraffic & traffic = s_netifTraffic[netif->num];
+    traffic.txBytes += p->tot_len;
+    traffic.txPackets++;
+    return traffic.linkoutput.load(std::memory_order_acquire)(netif, p);
+}
+
+/**
+ * @brief Wraps the input and linkoutput callbacks of a netif, must run in the TCP/IP context.
+ * @param netif Netif to wrap.
+ */
+static void hookNetif(struct netif * netif)
+{
+    // Only link-layer interfaces carry traffic worth counting, this skips loopback
+    if (netif->num >= NETIF_COUNTERS_MAX || netif->linkoutput == nullptr || netif->linkoutput == countingNetifLinkoutput)
+    {
+        return;
+    }
+
+    // The driver calls input from its own task, so the original must be visible before the wrapper is
+    NetifTraffic & traffic = s_netifTraffic[netif->num];
+    traffic.input.store(netif->input, std::memory_order_release);
+    traffic.linkoutput.store(netif->linkoutput, std::memory_order_release);
+    __atomic_store_n(&netif->input, &countingNetifInput, __ATOMIC_RELEASE);
+    __atomic_store_n(&netif->linkoutput, &countingNetifLinkoutput, __ATOMIC_RELEASE);
+
+    // The collector reads the name from here, it never walks the live netif list
+    traffic.hooked.store(false, std::memory_order_release);
+    traffic.name[0] = netif->name[0];
+    traffic.name[1] = netif->name[1];
+    traffic.hooked.store(true, std::memory_order_release);
+}
+
+#if LWIP_NETIF_EXT_STATUS_CALLBACK
+NETIF_DECLARE_EXT_CALLBACK(s_netifExtCallback)
+
+static void netifExtCallback(struct netif * netif, netif_nsc_reason_t reason, const netif_ext_callback_args_t * args)
+{
+    if (reason & LWIP_NSC_NETIF_ADDED)
+    {
+        hookNetif(netif);
+    }
+    if ((reason & LWIP_NSC_NETIF_REMOVED) && netif->num < NETIF_COUNTERS_MAX)
+    {
+        s_netifTraffic[netif->num].hooked.store(false, std::memory_order_release);
+    }
+}
+#endif
+
+/**
+ * @brief Wraps the existing netifs and those added later, run once in the TCP/IP context.
+ * @param ctx Unused.
+ * @return ESP_OK.
+ */
+static esp_err_t installNetifHooks(void * ctx)
+{
+    static bool installed = false;
+    if (installed)
+    {
+        return ESP_OK;
+    }
+
+    struct netif * netif;
+    NETIF_FOREACH(netif)
+    {
+        hookNetif(netif);
+    }
+#if LWIP_NETIF_EXT_STATUS_CALLBACK
+    netif_add_ext_callback(&s_netifExtCallback, netifExtCallback);
+#endif
+    installed = true;
+    return ESP_OK;
+}
+#endif
 
 MetricsModule::MetricsModule(const char * databaseUrl, const char * deviceLocation, const char * token) :
-    m_senderTaskHandle(nullptr), m_databaseUrl(databaseUrl), m_deviceLocation(deviceLocation), m_token(token)
+    m_snapshot(nullptr), m_senderTaskHandle(nullptr), m_databaseUrl(databaseUrl), m_deviceLocation(deviceLocation), m_token(token),
+    m_sinks(), m_sinkCount(0), m_networkCounters(), m_wifiDisconnects(0), m_wifiLastDisconnectReason(0),
+    m_wifiEventHandler(nullptr), m_selfStats(), m_stackWatches(nullptr), m_stackWatchCount(0),
+    m_stackWatchNext(0), m_stackWatchDeletions(0), m_stackSuspendMaxUs(0), m_stackStepMaxUs(0),
+    m_truncatedMetrics(0)
 {
     ESP_LOGI(TAG, "MetricsModule created");
 
@@ -41,16 +264,9 @@ MetricsModule::MetricsModule(const char * databaseUrl, const char * deviceLocati
     snprintf(fullURL, urlSize, "%s", m_databaseUrl);
     m_databaseUrl = fullURL;
 
-    m_metricsBuffer = (char *) calloc(CONFIG_M_M_BUFFER_SIZE, sizeof(char));
-    if (m_metricsBuffer == nullptr)
+    if (generateDeviceId() != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to allocate memory for metrics buffer");
-        return;
-    }
-
-    if (generateRandomDeviceId() != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to generate random device ID");
+        ESP_LOGE(TAG, "Failed to generate device ID");
     }
 }
 
@@ -60,18 +276,53 @@ MetricsModule::~MetricsModule()
     {
         vTaskDelete(m_senderTaskHandle);
     }
-    free(m_metricsBuffer);
+    if (m_wifiEventHandler != nullptr)
+    {
+        esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, m_wifiEventHandler);
+    }
+    for (size_t i = 0; i < m_sinkCount; i++)
+    {
+        delete m_sinks[i];
+    }
+    if (m_snapshot != nullptr)
+    {
+        m_snapshot->release();
+    }
+    free(m_stackWatches);
     free((void *) m_databaseUrl);
     free((void *) m_deviceId);
 
     ESP_LOGI(TAG, "MetricsModule destroyed");
 }
 
+esp_err_t MetricsModule::addSink(const MetricsSinkConfig & config)
+{
+    if (m_senderTaskHandle != nullptr)
+    {
+        ESP_LOGE(TAG, "Sinks cannot be added after start");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (m_sinkCount >= CONFIG_M_M_MAX_SINKS)
+    {
+        ESP_LOGE(TAG, "Too many sinks, increase CONFIG_M_M_MAX_SINKS");
+        return ESP_ERR_NO_MEM;
+    }
+
+    MetricsSink * sink = new (std::nothrow) MetricsSink(config, m_deviceId);
+    if (sink == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for sink");
+        return ESP_ERR_NO_MEM;
+    }
+    m_sinks[m_sinkCount++] = sink;
+    return ESP_OK;
+}
+
 esp_err_t MetricsModule::start()
 {
-    if (m_metricsBuffer == nullptr)
+    if (m_deviceId == nullptr)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
+        ESP_LOGE(TAG, "Device ID is not allocated");
         return ESP_ERR_NO_MEM;
     }
     if (m_senderTaskHandle != nullptr)
@@ -84,9 +335,45 @@ esp_err_t MetricsModule::start()
         ESP_LOGW(TAG, "MetricsModule is disabled. Enable it by setting CONFIG_M_M_ENABLED to y in sdkconfig.");
         return ESP_OK;
     }
+    if (m_sinkCount == 0)
+    {
+        esp_err_t err = addDefaultSink();
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    // A sink that fails to start only loses its own metrics
+    size_t startedSinks = 0;
+    for (size_t i = 0; i < m_sinkCount; i++)
+    {
+        if (m_sinks[i]->start(i) == ESP_OK)
+        {
+            startedSinks++;
+        }
+    }
+    if (startedSinks == 0)
+    {
+        ESP_LOGE(TAG, "No sink could be started");
+        return ESP_FAIL;
+    }
+
+#if CONFIG_M_M_NETWORK_STATS
+    if (esp_netif_tcpip_exec(installNetifHooks, nullptr) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to install netif hooks, per-netif traffic will not be counted");
+    }
+    primeNetworkCounters();
+    if (esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &MetricsModule::wifiEventHandler, this,
+                                            &m_wifiEventHandler) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to register Wi-Fi event handler, disconnects will not be counted");
+    }
+#endif
     ESP_LOGI(TAG, "Starting metrics sender task");
-    if (xTaskCreate(&MetricsModule::senderTask, "metrics_sender_task", CONFIG_M_M_TASK_STACK_SIZE, this, CONFIG_M_M_TASK_PRIORITY,
-                    &m_senderTaskHandle) != pdPASS)
+    if (xTaskCreatePinnedToCore(&MetricsModule::senderTask, "metrics_sender_task", CONFIG_M_M_TASK_STACK_SIZE, this,
+                                CONFIG_M_M_TASK_PRIORITY, &m_senderTaskHandle, M_M_TASK_CORE_ID) != pdPASS)
     {
         ESP_LOGE(TAG, "Failed to create metrics sender task");
         return ESP_FAIL;
@@ -99,165 +386,177 @@ void MetricsModule::senderTask(void * pvParameters)
     MetricsModule * self = (MetricsModule *) pvParameters;
     while (true)
     {
-        if (self->resetBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to reset buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addPrefixJsonToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add prefix JSON to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addTokenToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add token to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addDeviceIdToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add device ID to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addLocationToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add location to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addFreeHeapToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add free heap to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addTasksFreeStackToBuffer() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to add tasks free stack to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addWifiRssiToBuffer() != ESP_OK)
+        int64_t buildStartUs = esp_timer_get_time();
+        self->m_snapshot     = new (std::nothrow) MetricsSnapshot();
+        if (self->m_snapshot == nullptr)
         {
-            ESP_LOGE(TAG, "Failed to add wifi RSSI to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
+            ESP_LOGE(TAG, "Failed to allocate memory for metrics snapshot");
+            self->waitForNextCycle();
             continue;
         }
-        if (!self->checkNetworkConnection())
-        {
-            ESP_LOGW(TAG, "No network connection or time not correct. Retrying in %d seconds", CONFIG_M_M_SEND_METRICS_PERIOD);
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
-        }
-        if (self->addPostfixJsonToBuffer() != ESP_OK)
+
+        esp_err_t err            = self->collectMetrics(buildStartUs);
+        self->m_truncatedMetrics = self->m_snapshot->droppedCount();
+        if (self->m_truncatedMetrics > 0)
         {
-            ESP_LOGE(TAG, "Failed to add postfix JSON to buffer");
-            vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
-            continue;
+            ESP_LOGW(TAG, "Metrics buffer full, %u metrics left out of the snapshot", (unsigned) self->m_truncatedMetrics);
         }
-        if (CONFIG_M_M_PRINT_METRICS_BUFFER)
+        if (err == ESP_OK)
         {
-            if (self->printMetricBuffer() != ESP_OK)
+            if (CONFIG_M_M_PRINT_METRICS_BUFFER)
             {
-                ESP_LOGE(TAG, "Failed to print metric buffer");
+                if (self->printMetricBuffer() != ESP_OK)
+                {
+                    ESP_LOGE(TAG, "Failed to print metric buffer");
+                }
+            }
+            // Every sink shares the same snapshot, each takes its own reference
+            for (size_t i = 0; i < self->m_sinkCount; i++)
+            {
+                self->m_sinks[i]->offer(self->m_snapshot);
             }
         }
-        if (self->sendBufferedMetrics() != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to send buffered metrics");
-        }
-        vTaskDelay(CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS);
+
+        MetricsSnapshot * snapshot = self->m_snapshot;
+        self->m_snapshot           = nullptr;
+        snapshot->release();
+        self->waitForNextCycle();
     }
 }
 
-esp_err_t MetricsModule::resetBuffer()
+void MetricsModule::waitForNextCycle()
 {
-    if (m_metricsBuffer == nullptr)
+    TickType_t periodTicks = CONFIG_M_M_SEND_METRICS_PERIOD * 1000 / portTICK_PERIOD_MS;
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+    // Spread the stack checks over the period so that every task is checked once before the next collection
+    UBaseType_t steps = (m_stackWatchCount + CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP - 1) / CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP;
+    if (steps == 0)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
-        return ESP_ERR_INVALID_STATE;
+        steps = 1;
     }
-    memset(m_metricsBuffer, 0, CONFIG_M_M_BUFFER_SIZE);
-    return ESP_OK;
+    TickType_t stepTicks = periodTicks / steps;
+    vTaskDelay(periodTicks - stepTicks * steps);
+    for (UBaseType_t i = 0; i < steps; i++)
+    {
+        vTaskDelay(stepTicks);
+        scanStacksStep();
+    }
+#else
+    vTaskDelay(periodTicks);
+#endif
 }
 
-esp_err_t MetricsModule::addPrefixJsonToBuffer()
+esp_err_t MetricsModule::collectMetrics(int64_t buildStartUs)
 {
-    if (m_metricsBuffer == nullptr)
+    if (addTokenToBuffer() != ESP_OK)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
-        return ESP_ERR_INVALID_STATE;
+        ESP_LOGE(TAG, "Failed to add token to buffer");
+        return ESP_FAIL;
+    }
+    if (addDeviceIdToBuffer() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add device ID to buffer");
+        return ESP_FAIL;
+    }
+    if (addLocationToBuffer() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add location to buffer");
+        return ESP_FAIL;
+    }
+#if CONFIG_M_M_SELF_STATS
+    // Added early so that it is not itself left out of a full snapshot
+    addMetricToBuffer("mmTruncatedMetrics", (int) m_truncatedMetrics);
+#endif
+    if (runCollector("Heap", &MetricsModule::addFreeHeapToBuffer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add free heap to buffer");
+        return ESP_FAIL;
     }
-    snprintf(m_metricsBuffer, CONFIG_M_M_BUFFER_SIZE, "{");
+    if (runCollector("Stacks", &MetricsModule::addTasksFreeStackToBuffer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add tasks free stack to buffer");
+        return ESP_FAIL;
+    }
+    if (runCollector("Wifi", &MetricsModule::addWifiRssiToBuffer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add wifi RSSI to buffer");
+        return ESP_FAIL;
+    }
+#if CONFIG_M_M_NETWORK_STATS
+    if (runCollector("Network", &MetricsModule::addNetworkStatsToBuffer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add network stats to buffer");
+        return ESP_FAIL;
+    }
+#endif
+    if (!checkNetworkConnection())
+    {
+        ESP_LOGW(TAG, "No network connection or time not correct. Retrying in %d seconds", CONFIG_M_M_SEND_METRICS_PERIOD);
+        return ESP_FAIL;
+    }
+#if CONFIG_M_M_SELF_STATS
+    if (addSelfStatsToBuffer(buildStartUs) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to add self stats to buffer");
+        return ESP_FAIL;
+    }
+#endif
     return ESP_OK;
 }
 
-esp_err_t MetricsModule::addPostfixJsonToBuffer()
+esp_err_t MetricsModule::addDefaultSink()
 {
-    if (m_metricsBuffer == nullptr)
-    {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
-        return ESP_ERR_INVALID_STATE;
-    }
-    strncat(m_metricsBuffer, "}", CONFIG_M_M_BUFFER_SIZE - strlen(m_metricsBuffer) - 1);
-    return ESP_OK;
+    MetricsSinkConfig config = {};
+#if CONFIG_M_M_TRANSPORT_MQTT
+    config.transport = METRICS_TRANSPORT_MQTT;
+    config.format    = METRICS_FORMAT_JSON;
+    config.mqttTopic = CONFIG_M_M_MQTT_TOPIC;
+    config.mqttQos   = CONFIG_M_M_MQTT_QOS;
+#elif CONFIG_M_M_TRANSPORT_UDP
+    config.transport = METRICS_TRANSPORT_UDP;
+    config.format    = METRICS_FORMAT_STATSD;
+#else
+    config.transport = METRICS_TRANSPORT_HTTP;
+    config.format    = METRICS_FORMAT_JSON;
+#endif
+    config.url         = m_databaseUrl;
+    config.periodSec   = 0;
+    config.batchSize   = 1;
+    config.queueLength = CONFIG_M_M_SINK_QUEUE_LENGTH;
+    return addSink(config);
 }
 
 esp_err_t MetricsModule::addMetricToBuffer(const char * metricName, const char * metricValue)
 {
-    if (m_metricsBuffer == nullptr)
+    if (m_snapshot == nullptr)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
+        ESP_LOGE(TAG, "Metrics snapshot is not allocated");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (strlen(m_metricsBuffer) + strlen(metricName) + strlen(metricValue) + 5 >= CONFIG_M_M_BUFFER_SIZE)
+    // Rejected metrics are counted by the snapshot and logged once it is complete
+    if (m_snapshot->add(metricName, metricValue) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Not enough space in metrics buffer to add metric");
         return ESP_ERR_NO_MEM;
     }
 
-    // Add a comma if this is not the first metric
-    if (strlen(m_metricsBuffer) > 1)
-    {
-        strncat(m_metricsBuffer, ",", CONFIG_M_M_BUFFER_SIZE - strlen(m_metricsBuffer) - 1);
-    }
-
-    // Format and add the metric to the buffer
-    snprintf(m_metricsBuffer + strlen(m_metricsBuffer), CONFIG_M_M_BUFFER_SIZE - strlen(m_metricsBuffer), "\"%s\":\"%s\"",
-             metricName, metricValue);
-
     return ESP_OK;
 }
 
 esp_err_t MetricsModule::addMetricToBuffer(const char * metricName, const int metricValue)
 {
-    if (m_metricsBuffer == nullptr)
+    if (m_snapshot == nullptr)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
+        ESP_LOGE(TAG, "Metrics snapshot is not allocated");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (strlen(m_metricsBuffer) + strlen(metricName) + 5 >= CONFIG_M_M_BUFFER_SIZE) // 20 characters for the integer value
+    // Rejected metrics are counted by the snapshot and logged once it is complete
+    if (m_snapshot->add(metricName, metricValue) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Not enough space in metrics buffer to add metric");
         return ESP_ERR_NO_MEM;
     }
 
-    // Add a comma if this is not the first metric
-    if (strlen(m_metricsBuffer) > 1)
-    {
-        strncat(m_metricsBuffer, ",", CONFIG_M_M_BUFFER_SIZE - strlen(m_metricsBuffer) - 1);
-    }
-
-    // Format and add the metric to the buffer
-    snprintf(m_metricsBuffer + strlen(m_metricsBuffer), CONFIG_M_M_BUFFER_SIZE - strlen(m_metricsBuffer), "\"%s\":%d", metricName,
-             metricValue);
-
     return ESP_OK;
 }
 
@@ -306,6 +605,32 @@ esp_err_t MetricsModule::addFreeHeapToBuffer()
 
 esp_err_t MetricsModule::addTasksFreeStackToBuffer()
 {
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+    if (stackWatchesStale())
+    {
+        esp_err_t err = refreshStackWatches();
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        // Reads the tasks found since the last step now, still a few at a time
+        UBaseType_t steps = (m_stackWatchCount + CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP - 1) / CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP;
+        for (UBaseType_t i = 0; i < steps; i++)
+        {
+            scanStacksStep();
+        }
+    }
+
+    // High water marks were read by the scan steps since the previous collection
+    for (UBaseType_t i = 0; i < m_stackWatchCount; i++)
+    {
+        if (m_stackWatches[i].highWaterMark != HIGH_WATER_MARK_UNKNOWN)
+        {
+            addMetricToBuffer(m_stackWatches[i].name, (int) m_stackWatches[i].highWaterMark);
+        }
+    }
+    return ESP_OK;
+#else
     TaskStatus_t * pxTaskStatusArray;
     volatile UBaseType_t uxArraySize;
 
@@ -323,67 +648,357 @@ esp_err_t MetricsModule::addTasksFreeStackToBuffer()
         return ESP_ERR_NO_MEM;
     }
 
-    uxArraySize = uxTaskGetSystemState(pxTaskStatusArray, uxArraySize, NULL);
+    // The scheduler is suspended while every task stack is scanned
+    int64_t startUs   = esp_timer_get_time();
+    uxArraySize       = uxTaskGetSystemState(pxTaskStatusArray, uxArraySize, NULL);
+    int64_t elapsedUs = esp_timer_get_time() - startUs;
+    if (elapsedUs > m_stackSuspendMaxUs)
+    {
+        m_stackSuspendMaxUs = elapsedUs;
+    }
+
     for (UBaseType_t i = 0; i < uxArraySize; i++)
     {
-        char metricName[40];
-        if (strcmp(pxTaskStatusArray[i].pcTaskName, "IDLE") == 0)
-        {
-            snprintf(metricName, sizeof(metricName), "IDLE_%d", (int) pxTaskStatusArray[i].xTaskNumber);
-        }
-        else
-        {
-            snprintf(metricName, sizeof(metricName), "%s", pxTaskStatusArray[i].pcTaskName);
-        }
+        char metricName[configMAX_TASK_NAME_LEN];
+        taskMetricName(pxTaskStatusArray[i].pcTaskName, pxTaskStatusArray[i].xTaskNumber, metricName, sizeof(metricName));
         addMetricToBuffer(metricName, (int) pxTaskStatusArray[i].usStackHighWaterMark);
     }
 
     free(pxTaskStatusArray);
     return ESP_OK;
+#endif
 }
 
-esp_err_t MetricsModule::sendBufferedMetrics()
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+esp_err_t MetricsModule::refreshStackWatches()
 {
-    if (m_metricsBuffer == nullptr || strlen(m_metricsBuffer) == 0)
+    UBaseType_t taskCount = uxTaskGetNumberOfTasks();
+    if (taskCount == 0)
     {
-        ESP_LOGW(TAG, "No metrics to send");
+        ESP_LOGW(TAG, "No tasks found");
+        return ESP_FAIL;
+    }
+
+    // Room for tasks created between counting and enumerating
+    taskCount += 2;
+    TaskSnapshot_t * snapshots = (TaskSnapshot_t *) malloc(taskCount * sizeof(TaskSnapshot_t));
+    StackWatch * watches       = (StackWatch *) malloc(taskCount * sizeof(StackWatch));
+    if (snapshots == nullptr || watches == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for stack watches");
+        free(snapshots);
+        free(watches);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Counted before enumerating, so that a task deleted during the enumeration makes the result stale
+    uint32_t deletions = taskDeletions();
+
+    // The only kernel lock of the incremental scan, taken when tasks are created or deleted. It copies the task
+    // handles without reading any stack, unlike uxTaskGetSystemState() which computes every high water mark.
+    UBaseType_t tcbSize;
+    int64_t startUs   = esp_timer_get_time();
+    taskCount         = uxTaskGetSnapshotAll(snapshots, taskCount, &tcbSize);
+    int64_t elapsedUs = esp_timer_get_time() - startUs;
+    if (elapsedUs > m_stackSuspendMaxUs)
+    {
+        m_stackSuspendMaxUs = elapsedUs;
+    }
+
+    // Names are read under the scan lock, where no task can be freed, unless one was deleted since the enumeration
+    portENTER_CRITICAL(&s_stackScanLock);
+    bool stale = (s_taskDeletions != deletions);
+    for (UBaseType_t i = 0; !stale && i < taskCount; i++)
+    {
+        TaskHandle_t handle = (TaskHandle_t) snapshots[i].pxTCB;
+        watches[i].handle   = handle;
+        taskMetricName(pcTaskGetName(handle), uxTaskGetTaskNumber(handle), watches[i].name, sizeof(watches[i].name));
+    }
+    portEXIT_CRITICAL(&s_stackScanLock);
+    free(snapshots);
+    if (stale)
+    {
+        // Enumerated again by the next step
+        free(watches);
         return ESP_OK;
     }
 
-    esp_http_client_config_t config = {
-        .url        = m_databaseUrl,
-        .method     = HTTP_METHOD_POST,
-        .timeout_ms = CONFIG_M_M_HTTP_TIMEOUT_MS,
-        .user_data  = this,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == nullptr)
+    // High water marks are read by the scan steps, those of tasks already watched are kept until then
+    for (UBaseType_t i = 0; i < taskCount; i++)
     {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client");
-        return ESP_FAIL;
+        watches[i].highWaterMark = HIGH_WATER_MARK_UNKNOWN;
+        for (UBaseType_t j = 0; j < m_stackWatchCount; j++)
+        {
+            if (m_stackWatches[j].handle == watches[i].handle && strcmp(m_stackWatches[j].name, watches[i].name) == 0)
+            {
+                watches[i].highWaterMark = m_stackWatches[j].highWaterMark;
+                break;
+            }
+        }
+    }
+    free(m_stackWatches);
+    m_stackWatches        = watches;
+    m_stackWatchCount     = taskCount;
+    m_stackWatchNext      = 0;
+    m_stackWatchDeletions = deletions;
+    return ESP_OK;
+}
+
+void MetricsModule::scanStacksStep()
+{
+    bool stale = (uxTaskGetNumberOfTasks() != m_stackWatchCount);
+
+    // Under the scan lock no task can be freed, so the handles are valid as long as no task was deleted since the
+    // enumeration. The lock is held for at most CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP stack reads.
+    int64_t startUs = esp_timer_get_time();
+    portENTER_CRITICAL(&s_stackScanLock);
+    stale = stale || (s_taskDeletions != m_stackWatchDeletions);
+    for (int i = 0; !stale && i < CONFIG_M_M_STACK_SCAN_TASKS_PER_STEP && i < (int) m_stackWatchCount; i++)
+    {
+        StackWatch & watch  = m_stackWatches[m_stackWatchNext];
+        watch.highWaterMark = uxTaskGetStackHighWaterMark(watch.handle);
+        m_stackWatchNext    = (m_stackWatchNext + 1) % m_stackWatchCount;
+    }
+    portEXIT_CRITICAL(&s_stackScanLock);
+    int64_t elapsedUs = esp_timer_get_time() - startUs;
+
+    if (stale)
+    {
+        if (refreshStackWatches() != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to enumerate tasks");
+        }
+        return;
+    }
+    if (elapsedUs > m_stackStepMaxUs)
+    {
+        m_stackStepMaxUs = elapsedUs;
     }
-    esp_err_t err;
-    err = esp_http_client_set_header(client, "Content-Type", "application/json");
+}
+
+bool MetricsModule::stackWatchesStale()
+{
+    return uxTaskGetNumberOfTasks() != m_stackWatchCount || taskDeletions() != m_stackWatchDeletions;
+}
+#endif
+
+esp_err_t MetricsModule::addNetworkStatsToBuffer()
+{
+    esp_err_t err = addLwipStatsToBuffer();
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to set HTTP header: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
+        ESP_LOGE(TAG, "Failed to add lwIP stats to buffer: %s", esp_err_to_name(err));
         return err;
     }
-    err = esp_http_client_set_post_field(client, m_metricsBuffer, strlen(m_metricsBuffer));
+
+    err = addNetifStatsToBuffer();
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to set HTTP post field: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
+        ESP_LOGE(TAG, "Failed to add netif stats to buffer: %s", esp_err_to_name(err));
         return err;
     }
-    err = esp_http_client_perform(client);
+
+    return addWifiLinkStatsToBuffer();
+}
+
+esp_err_t MetricsModule::addLwipStatsToBuffer()
+{
+#if CONFIG_M_M_NETWORK_STATS
+#if MIB2_STATS
+    addMetricToBuffer("tcpRetransmits", counterDelta(lwip_stats.mib2.tcpretranssegs, m_networkCounters.tcpRetransmits));
+#endif
+    addMetricToBuffer("tcpDrops", counterDelta(lwip_stats.tcp.drop, m_networkCounters.tcpDrops));
+    addMetricToBuffer("tcpErrors", counterDelta(lwipTcpErrors(), m_networkCounters.tcpErrors));
+    addMetricToBuffer("ipDrops", counterDelta(lwip_stats.ip.drop, m_networkCounters.ipDrops));
+
+    // Current usage and high water mark of each pool, failed allocations as a single delta
+    for (const auto & pool : s_lwipPools)
+    {
+        const struct stats_mem * stats = lwip_stats.memp[pool.pool];
+        if (stats == nullptr)
+        {
+            continue;
+        }
+
+        char metricName[40];
+        snprintf(metricName, sizeof(metricName), "%sUsed", pool.name);
+        addMetricToBuffer(metricName, (int) stats->used);
+        snprintf(metricName, sizeof(metricName), "%sMax", pool.name);
+        addMetricToBuffer(metricName, (int) stats->max);
+    }
+    addMetricToBuffer("poolErrors", counterDelta(lwipPoolErrors(), m_networkCounters.poolErrors));
+#endif
+    return ESP_OK;
+}
+
+void MetricsModule::primeNetworkCounters()
+{
+#if CONFIG_M_M_NETWORK_STATS
+    // Counters accumulated since boot are not part of the first interval
+#if MIB2_STATS
+    m_networkCounters.tcpRetransmits = lwip_stats.mib2.tcpretranssegs;
+#endif
+    m_networkCounters.tcpDrops        = lwip_stats.tcp.drop;
+    m_networkCounters.tcpErrors       = lwipTcpErrors();
+    m_networkCounters.ipDrops         = lwip_stats.ip.drop;
+    m_networkCounters.poolErrors      = lwipPoolErrors();
+    m_networkCounters.wifiDisconnects = m_wifiDisconnects.load();
+    for (int i = 0; i < NETIF_COUNTERS_MAX; i++)
+    {
+        m_networkCounters.netifRxBytes[i]   = s_netifTraffic[i].rxBytes;
+        m_networkCounters.netifTxBytes[i]   = s_netifTraffic[i].txBytes;
+        m_networkCounters.netifRxPackets[i] = s_netifTraffic[i].rxPackets;
+        m_networkCounters.netifTxPackets[i] = s_netifTraffic[i].txPackets;
+    }
+#endif
+}
+
+esp_err_t MetricsModule::addNetifStatsToBuffer()
+{
+#if CONFIG_M_M_NETWORK_STATS
+    // Only netifs wrapped in the TCP/IP context are reported, loopback and netifs beyond NETIF_COUNTERS_MAX are not
+    for (int num = 0; num < NETIF_COUNTERS_MAX; num++)
+    {
+        NetifTraffic & traffic = s_netifTraffic[num];
+        if (!traffic.hooked.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        char metricName[40];
+        snprintf(metricName, sizeof(metricName), "%c%c%dRxBytes", traffic.name[0], traffic.name[1], num);
+        addMetricToBuffer(metricName, counterDelta((uint32_t) traffic.rxBytes, m_networkCounters.netifRxBytes[num]));
+        snprintf(metricName, sizeof(metricName), "%c%c%dTxBytes", traffic.name[0], traffic.name[1], num);
+        addMetricToBuffer(metricName, counterDelta((uint32_t) traffic.txBytes, m_networkCounters.netifTxBytes[num]));
+        snprintf(metricName, sizeof(metricName), "%c%c%dRxPackets", traffic.name[0], traffic.name[1], num);
+        addMetricToBuffer(metricName, counterDelta((uint32_t) traffic.rxPackets, m_networkCounters.netifRxPackets[num]));
+        snprintf(metricName, sizeof(metricName), "%c%c%dTxPackets", traffic.name[0], traffic.name[1], num);
+        addMetricToBuffer(metricName, counterDelta((uint32_t) traffic.txPackets, m_networkCounters.netifTxPackets[num]));
+    }
+#endif
+    return ESP_OK;
+}
+
+esp_err_t MetricsModule::addWifiLinkStatsToBuffer()
+{
+    wifi_ap_record_t ap_info;
+    esp_err_t err = esp_wifi_sta_get_ap_info(&ap_info);
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to perform HTTP request: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Failed to get AP info: %s", esp_err_to_name(err));
+        return err;
+    }
+    addMetricToBuffer("wifiChannel", (int) ap_info.primary);
+
+    // The driver does not expose the current PHY rate, report the negotiated mode and bandwidth instead
+    wifi_phy_mode_t phyMode;
+    if (esp_wifi_sta_get_negotiated_phymode(&phyMode) == ESP_OK)
+    {
+        addMetricToBuffer("wifiPhyMode", (int) phyMode);
+    }
+    wifi_bandwidth_t bandwidth;
+    if (esp_wifi_get_bandwidth(WIFI_IF_STA, &bandwidth) == ESP_OK)
+    {
+        addMetricToBuffer("wifiBandwidth", (int) bandwidth);
+    }
+
+    addMetricToBuffer("wifiDisconnects", counterDelta(m_wifiDisconnects.load(), m_networkCounters.wifiDisconnects));
+    return addMetricToBuffer("wifiLastDisconnectReason", (int) m_wifiLastDisconnectReason.load());
+}
+
+void MetricsModule::wifiEventHandler(void * arg, esp_event_base_t eventBase, int32_t eventId, void * eventData)
+{
+    MetricsModule * self                  = (MetricsModule *) arg;
+    wifi_event_sta_disconnected_t * event = (wifi_event_sta_disconnected_t *) eventData;
+
+    self->m_wifiDisconnects++;
+    self->m_wifiLastDisconnectReason = event->reason;
+}
+
+esp_err_t MetricsModule::runCollector(const char * name, esp_err_t (MetricsModule::*collector)())
+{
+#if CONFIG_M_M_SELF_STATS
+    int64_t startUs = esp_timer_get_time();
+    esp_err_t err   = (this->*collector)();
+    if (err == ESP_OK)
+    {
+        char metricName[40];
+        snprintf(metricName, sizeof(metricName), "mm%sUs", name);
+        addMetricToBuffer(metricName, (int) (esp_timer_get_time() - startUs));
     }
-    esp_http_client_cleanup(client);
     return err;
+#else
+    return (this->*collector)();
+#endif
+}
+
+esp_err_t MetricsModule::addSelfStatsToBuffer(int64_t buildStartUs)
+{
+    int64_t nowUs = esp_timer_get_time();
+    addMetricToBuffer("mmBuildUs", (int) (nowUs - buildStartUs));
+    addMetricToBuffer("mmStackSuspendUs", (int) m_stackSuspendMaxUs);
+#if CONFIG_M_M_STACK_SCAN_INCREMENTAL
+    addMetricToBuffer("mmStackStepUs", (int) m_stackStepMaxUs);
+#endif
+    m_stackSuspendMaxUs = 0;
+    m_stackStepMaxUs    = 0;
+
+    for (size_t i = 0; i < m_sinkCount; i++)
+    {
+        if (m_sinks[i]->taskHandle() == nullptr)
+        {
+            continue; // The sink failed to start
+        }
+        MetricsSinkStats sinkStats  = m_sinks[i]->stats();
+        MetricsTransportStats stats = m_sinks[i]->transportStats();
+        addSinkMetricToBuffer(i, "SerializeUs", (int) sinkStats.serializeUs);
+        addSinkMetricToBuffer(i, "PayloadBytes", (int) sinkStats.payloadBytes);
+        addSinkMetricToBuffer(i, "Drops", (int) sinkStats.drops);
+        addSinkMetricToBuffer(i, "SerializeFailures", (int) sinkStats.serializeFailures);
+        addSinkMetricToBuffer(i, "DnsUs", (int) stats.dnsUs);
+        addSinkMetricToBuffer(i, "ConnectUs", (int) stats.connectUs);
+        addSinkMetricToBuffer(i, "TtfbUs", (int) stats.ttfbUs);
+        addSinkMetricToBuffer(i, "SendUs", (int) stats.sendUs);
+        addSinkMetricToBuffer(i, "SendFailures", (int) stats.sendFailures);
+        addSinkMetricToBuffer(i, "SendRetries", (int) stats.sendRetries);
+    }
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_RUN_TIME_STATS_USING_ESP_TIMER
+    // Share of one core used by each task since the previous cycle, in permille
+    int64_t elapsedUs = nowUs - m_selfStats.taskRunTimeAtUs;
+    TaskStatus_t status;
+    vTaskGetInfo(nullptr, &status, pdFALSE, eRunning);
+    if (m_selfStats.taskRunTimeAtUs != 0 && elapsedUs > 0)
+    {
+        uint32_t runTime = status.ulRunTimeCounter - m_selfStats.taskRunTime;
+        addMetricToBuffer("mmCpuPermille", (int) ((int64_t) runTime * 1000 / elapsedUs));
+    }
+    m_selfStats.taskRunTime = status.ulRunTimeCounter;
+
+    for (size_t i = 0; i < m_sinkCount; i++)
+    {
+        if (m_sinks[i]->taskHandle() == nullptr)
+        {
+            continue;
+        }
+        vTaskGetInfo(m_sinks[i]->taskHandle(), &status, pdFALSE, eInvalid);
+        if (m_selfStats.taskRunTimeAtUs != 0 && elapsedUs > 0)
+        {
+            uint32_t runTime = status.ulRunTimeCounter - m_selfStats.sinkRunTime[i];
+            addSinkMetricToBuffer(i, "CpuPermille", (int) ((int64_t) runTime * 1000 / elapsedUs));
+        }
+        m_selfStats.sinkRunTime[i] = status.ulRunTimeCounter;
+    }
+    m_selfStats.taskRunTimeAtUs = nowUs;
+#endif
+    return ESP_OK;
+}
+
+esp_err_t MetricsModule::addSinkMetricToBuffer(size_t index, const char * name, int value)
+{
+    char metricName[40];
+    snprintf(metricName, sizeof(metricName), "mmSink%d%s", (int) index, name);
+    return addMetricToBuffer(metricName, value);
 }
 
 bool MetricsModule::checkNetworkConnection()
@@ -412,42 +1027,63 @@ bool MetricsModule::checkNetworkConnection()
 
 esp_err_t MetricsModule::printMetricBuffer()
 {
-    if (m_metricsBuffer == nullptr)
+    if (m_snapshot == nullptr)
     {
-        ESP_LOGE(TAG, "Metrics buffer is not allocated");
+        ESP_LOGE(TAG, "Metrics snapshot is not allocated");
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGI(TAG, "URL: %s", m_databaseUrl);
-    ESP_LOGI(TAG, "Metrics buffer: \n%s\n", m_metricsBuffer);
-    return ESP_OK;
+
+    char * json = (char *) malloc(CONFIG_M_M_BUFFER_SIZE);
+    if (json == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for printing metrics");
+        return ESP_ERR_NO_MEM;
+    }
+    size_t length;
+    esp_err_t err = m_snapshot->toJson(json, CONFIG_M_M_BUFFER_SIZE, &length);
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Metrics buffer: \n%s\n", json);
+    }
+    free(json);
+    return err;
 }
 
-esp_err_t MetricsModule::generateRandomDeviceId()
+esp_err_t MetricsModule::generateDeviceId()
 {
-    // Array to hold random bytes
-    uint8_t randomBytes[DEVICEID_SIZE];
-    esp_fill_random(randomBytes, DEVICEID_SIZE);
-
-    // Array to hold the device ID string with quotes and null terminator
+    // Array to hold the device ID string and null terminator
     char deviceId[DEVICEID_SIZE + 1];
 
-    // Convert random bytes to English letters
-    for (int i = 0; i < DEVICEID_SIZE; i++)
+    // The station MAC keeps the ID, and with it MQTT sessions and StatsD series, stable across reboots
+    uint8_t mac[6];
+    if (esp_read_mac(mac, ESP_MAC_WIFI_STA) == ESP_OK)
     {
-        uint8_t randValue = randomBytes[i] % 52; // 52 letters in the English alphabet (26 uppercase + 26 lowercase)
-        if (randValue < 26)
-        {
-            deviceId[i] = 'A' + randValue; // Map to uppercase letters
-        }
-        else
+        snprintf(deviceId, sizeof(deviceId), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to read MAC address, using a random device ID");
+
+        // Array to hold random bytes
+        uint8_t randomBytes[DEVICEID_SIZE];
+        esp_fill_random(randomBytes, DEVICEID_SIZE);
+
+        // Convert random bytes to English letters
+        for (int i = 0; i < DEVICEID_SIZE; i++)
         {
-            deviceId[i] = 'a' + (randValue - 26); // Map to lowercase letters
+            uint8_t randValue = randomBytes[i] % 52; // 52 letters in the English alphabet (26 uppercase + 26 lowercase)
+            if (randValue < 26)
+            {
+                deviceId[i] = 'A' + randValue; // Map to uppercase letters
+            }
+            else
+            {
+                deviceId[i] = 'a' + (randValue - 26); // Map to lowercase letters
+            }
         }
+        deviceId[DEVICEID_SIZE] = '\0';
     }
 
-    // Add the closing quote and null terminator
-    deviceId[DEVICEID_SIZE] = '\0';
-
     // Duplicate the string to m_deviceId
     m_deviceId = strdup(deviceId);
     if (m_deviceId == nullptr)
@@ -457,7 +1093,7 @@ esp_err_t MetricsModule::generateRandomDeviceId()
     }
 
     // Log the generated device ID
-    ESP_LOGI(TAG, "Generated random device ID: %s", m_deviceId);
+    ESP_LOGI(TAG, "Device ID: %s", m_deviceId);
 
     return ESP_OK;
 }
@@ -0,0 +1,284 @@
+#include "MetricsSink.hpp"
+#include "HttpTransport.hpp"
+#include "MetricsTaskConfig.hpp"
+#include "MqttTransport.hpp"
+#include "UdpTransport.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+static const char * TAG = "MetricsSink";
+
+MetricsSink::MetricsSink(const MetricsSinkConfig & config, const char * deviceId) :
+    m_config(config), m_deviceId(deviceId), m_transport(nullptr), m_queue(nullptr), m_taskHandle(nullptr), m_batch(nullptr),
+    m_payload(nullptr), m_payloadSize(0), m_lastOfferUs(0), m_stats()
+{
+    portMUX_INITIALIZE(&m_statsLock);
+    m_config.url       = strdup(config.url != nullptr ? config.url : "");
+    m_config.mqttTopic = strdup(config.mqttTopic != nullptr ? config.mqttTopic : "metrics");
+    if (m_config.url == nullptr || m_config.mqttTopic == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for sink configuration");
+        return;
+    }
+    if (m_config.batchSize == 0)
+    {
+        m_config.batchSize = 1;
+    }
+    if (m_config.queueLength == 0)
+    {
+        m_config.queueLength = 1;
+    }
+
+    m_queue = xQueueCreate(m_config.queueLength, sizeof(MetricsSnapshot *));
+    if (m_queue == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to create sink queue");
+        return;
+    }
+
+    m_batch = (MetricsSnapshot **) calloc(m_config.batchSize, sizeof(MetricsSnapshot *));
+    if (m_batch == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for sink batch");
+        return;
+    }
+
+    // The JSON of a snapshot always fits in CONFIG_M_M_BUFFER_SIZE, StatsD lines add the prefix and device ID to every
+    // metric name, and a JSON array adds its brackets
+    size_t snapshotSize = CONFIG_M_M_BUFFER_SIZE;
+    if (m_config.format == METRICS_FORMAT_STATSD)
+    {
+        size_t deviceIdLength = (m_deviceId != nullptr) ? strlen(m_deviceId) : 0;
+        snapshotSize += (size_t) CONFIG_M_M_MAX_METRICS * (strlen(CONFIG_M_M_STATSD_PREFIX) + deviceIdLength + 2);
+    }
+    m_payloadSize = (size_t) m_config.batchSize * snapshotSize + 2;
+    m_payload     = (char *) malloc(m_payloadSize);
+    if (m_payload == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for sink payload");
+        return;
+    }
+
+    if (createTransport() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to create sink transport");
+    }
+}
+
+MetricsSink::~MetricsSink()
+{
+    if (m_taskHandle != nullptr)
+    {
+        vTaskDelete(m_taskHandle);
+    }
+    if (m_queue != nullptr)
+    {
+        MetricsSnapshot * snapshot;
+        while (xQueueReceive(m_queue, &snapshot, 0) == pdTRUE)
+        {
+            snapshot->release();
+        }
+        vQueueDelete(m_queue);
+    }
+    if (m_batch != nullptr)
+    {
+        for (size_t i = 0; i < m_config.batchSize; i++)
+        {
+            if (m_batch[i] != nullptr)
+            {
+                m_batch[i]->release();
+            }
+        }
+    }
+    delete m_transport;
+    free(m_batch);
+    free(m_payload);
+    free((void *) m_config.url);
+    free((void *) m_config.mqttTopic);
+}
+
+esp_err_t MetricsSink::start(size_t index)
+{
+    char name[configMAX_TASK_NAME_LEN];
+    snprintf(name, sizeof(name), "metrics_sink_%d", (int) index);
+
+    if (m_queue == nullptr || m_batch == nullptr || m_payload == nullptr || m_transport == nullptr)
+    {
+        ESP_LOGE(TAG, "Sink %s is not initialized", name);
+        return ESP_ERR_NO_MEM;
+    }
+    if (m_taskHandle != nullptr)
+    {
+        ESP_LOGE(TAG, "Sink %s already running", name);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Sinks on the same broker need distinct client IDs, or they take over each other's session
+    char clientId[32];
+    snprintf(clientId, sizeof(clientId), "%s_%d", m_deviceId, (int) index);
+    esp_err_t err = m_transport->start(clientId);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start transport of sink %s: %s", name, esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Starting sink %s to %s", name, m_config.url);
+    if (xTaskCreatePinnedToCore(&MetricsSink::sinkTask, name, CONFIG_M_M_SINK_TASK_STACK_SIZE, this, CONFIG_M_M_TASK_PRIORITY,
+                                &m_taskHandle, M_M_TASK_CORE_ID) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create task of sink %s", name);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+MetricsSinkStats MetricsSink::stats() const
+{
+    portENTER_CRITICAL(&m_statsLock);
+    MetricsSinkStats stats = m_stats;
+    portEXIT_CRITICAL(&m_statsLock);
+    return stats;
+}
+
+void MetricsSink::offer(MetricsSnapshot * snapshot)
+{
+    if (m_taskHandle == nullptr)
+    {
+        return;
+    }
+
+    // Half a collection period of slack keeps jitter from making the sink skip a snapshot it is due for
+    int64_t nowUs = esp_timer_get_time();
+    if (m_lastOfferUs != 0 &&
+        nowUs - m_lastOfferUs + CONFIG_M_M_SEND_METRICS_PERIOD * 500000LL < (int64_t) m_config.periodSec * 1000000LL)
+    {
+        return;
+    }
+    m_lastOfferUs = nowUs;
+
+    snapshot->retain();
+    if (xQueueSend(m_queue, &snapshot, 0) == pdTRUE)
+    {
+        return;
+    }
+
+    // The queue is full, the destination is slow or unreachable: drop the oldest snapshot to keep the freshest
+    MetricsSnapshot * oldest;
+    if (xQueueReceive(m_queue, &oldest, 0) == pdTRUE)
+    {
+        oldest->release();
+        portENTER_CRITICAL(&m_statsLock);
+        m_stats.drops++;
+        portEXIT_CRITICAL(&m_statsLock);
+    }
+    if (xQueueSend(m_queue, &snapshot, 0) != pdTRUE)
+    {
+        snapshot->release();
+        portENTER_CRITICAL(&m_statsLock);
+        m_stats.drops++;
+        portEXIT_CRITICAL(&m_statsLock);
+    }
+}
+
+void MetricsSink::sinkTask(void * pvParameters)
+{
+    MetricsSink * self = (MetricsSink *) pvParameters;
+    while (true)
+    {
+        for (size_t i = 0; i < self->m_config.batchSize; i++)
+        {
+            xQueueReceive(self->m_queue, &self->m_batch[i], portMAX_DELAY);
+        }
+
+        size_t length = 0;
+        if (self->serialize(self->m_config.batchSize, &length) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to serialize metrics for %s", self->m_config.url);
+            portENTER_CRITICAL(&self->m_statsLock);
+            self->m_stats.serializeFailures++;
+            portEXIT_CRITICAL(&self->m_statsLock);
+        }
+        else if (self->m_transport->send(self->m_payload, length) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to send metrics to %s", self->m_config.url);
+        }
+        self->m_transport->publishStats();
+
+        for (size_t i = 0; i < self->m_config.batchSize; i++)
+        {
+            MetricsSnapshot * snapshot = self->m_batch[i];
+            self->m_batch[i]           = nullptr;
+            snapshot->release();
+        }
+    }
+}
+
+esp_err_t MetricsSink::createTransport()
+{
+    switch (m_config.transport)
+    {
+    case METRICS_TRANSPORT_MQTT:
+        // The outbox holds no more undelivered payloads than the sink queue holds snapshots
+        m_transport = new (std::nothrow)
+            MqttTransport(m_config.url, m_config.mqttTopic, m_config.mqttQos, (size_t) m_config.queueLength * m_payloadSize);
+        break;
+    case METRICS_TRANSPORT_UDP:
+        m_transport = new (std::nothrow) UdpTransport(m_config.url);
+        break;
+    default:
+        m_transport = new (std::nothrow)
+            HttpTransport(m_config.url, (m_config.format == METRICS_FORMAT_JSON) ? "application/json" : "text/plain");
+        break;
+    }
+    if (m_transport == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for sink transport");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t MetricsSink::serialize(size_t count, size_t * length)
+{
+    int64_t startUs = esp_timer_get_time();
+    bool jsonArray  = (m_config.format == METRICS_FORMAT_JSON && count > 1);
+    size_t reserved = jsonArray ? 1 : 0; // Room for the "," or "]" that follows each snapshot
+    size_t used     = 0;
+    esp_err_t err   = ESP_OK;
+
+    if (jsonArray)
+    {
+        m_payload[used++] = '[';
+    }
+    for (size_t i = 0; i < count && err == ESP_OK; i++)
+    {
+        size_t written = 0;
+        if (m_config.format == METRICS_FORMAT_STATSD)
+        {
+            err = m_batch[i]->toStatsd(CONFIG_M_M_STATSD_PREFIX, m_deviceId, m_payload + used, m_payloadSize - used, &written);
+        }
+        else
+        {
+            err = m_batch[i]->toJson(m_payload + used, m_payloadSize - used - reserved, &written);
+        }
+        used += written;
+        if (jsonArray && err == ESP_OK)
+        {
+            m_payload[used++] = (i + 1 < count) ? ',' : ']';
+            m_payload[used]   = '\0';
+        }
+    }
+
+    int64_t serializeUs = esp_timer_get_time() - startUs;
+    *length             = used;
+    portENTER_CRITICAL(&m_statsLock);
+    m_stats.payloadBytes = used;
+    m_stats.serializeUs  = serializeUs;
+    portEXIT_CRITICAL(&m_statsLock);
+    return err;
+}
@@ -0,0 +1,189 @@
+#include "MetricsSnapshot.hpp"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STRING_VALUE_NONE UINT16_MAX
+
+/**
+ * @brief Appends formatted text to a buffer.
+ * @param out Buffer to append to.
+ * @param size Size of the buffer.
+ * @param used Bytes already used in the buffer, advanced by the bytes written.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the text does not fit.
+ */
+static esp_err_t appendFormat(char * out, size_t size, size_t * used, const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(out + *used, size - *used, format, args);
+    va_end(args);
+    if (written < 0 || *used + written >= size)
+    {
+        out[*used] = '\0';
+        return ESP_ERR_NO_MEM;
+    }
+    *used += written;
+    return ESP_OK;
+}
+
+MetricsSnapshot::MetricsSnapshot() : m_refCount(1), m_entryCount(0), m_stringsUsed(0), m_jsonLength(strlen("{}")), m_droppedCount(0)
+{}
+
+size_t MetricsSnapshot::droppedCount() const
+{
+    return m_droppedCount;
+}
+
+void MetricsSnapshot::retain()
+{
+    m_refCount.fetch_add(1);
+}
+
+void MetricsSnapshot::release()
+{
+    if (m_refCount.fetch_sub(1) == 1)
+    {
+        delete this;
+    }
+}
+
+esp_err_t MetricsSnapshot::add(const char * name, const char * value)
+{
+    if (m_entryCount >= CONFIG_M_M_MAX_METRICS)
+    {
+        m_droppedCount++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // "name":"value"
+    size_t jsonLength = jsonLengthWith(strlen(name) + strlen(value) + 5);
+    if (jsonLength >= CONFIG_M_M_BUFFER_SIZE)
+    {
+        m_droppedCount++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    Entry & entry   = m_entries[m_entryCount];
+    size_t rollback = m_stringsUsed;
+    esp_err_t err   = addString(name, &entry.nameOffset);
+    if (err == ESP_OK)
+    {
+        err = addString(value, &entry.valueOffset);
+    }
+    if (err != ESP_OK)
+    {
+        m_stringsUsed = rollback;
+        m_droppedCount++;
+        return err;
+    }
+    entry.value  = 0;
+    m_jsonLength = jsonLength;
+    m_entryCount++;
+    return ESP_OK;
+}
+
+esp_err_t MetricsSnapshot::add(const char * name, int value)
+{
+    if (m_entryCount >= CONFIG_M_M_MAX_METRICS)
+    {
+        m_droppedCount++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // "name":value
+    size_t jsonLength = jsonLengthWith(strlen(name) + 3 + snprintf(nullptr, 0, "%d", value));
+    if (jsonLength >= CONFIG_M_M_BUFFER_SIZE)
+    {
+        m_droppedCount++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    Entry & entry = m_entries[m_entryCount];
+    esp_err_t err = addString(name, &entry.nameOffset);
+    if (err != ESP_OK)
+    {
+        m_droppedCount++;
+        return err;
+    }
+    entry.valueOffset = STRING_VALUE_NONE;
+    entry.value       = value;
+    m_jsonLength      = jsonLength;
+    m_entryCount++;
+    return ESP_OK;
+}
+
+esp_err_t MetricsSnapshot::toJson(char * out, size_t size, size_t * length) const
+{
+    size_t used = 0;
+    if (size == 0)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    out[0] = '\0';
+
+    esp_err_t err = appendFormat(out, size, &used, "{");
+    for (size_t i = 0; i < m_entryCount && err == ESP_OK; i++)
+    {
+        const Entry & entry = m_entries[i];
+        const char * comma  = (i > 0) ? "," : "";
+        if (entry.valueOffset == STRING_VALUE_NONE)
+        {
+            err = appendFormat(out, size, &used, "%s\"%s\":%d", comma, &m_strings[entry.nameOffset], (int) entry.value);
+        }
+        else
+        {
+            err = appendFormat(out, size, &used, "%s\"%s\":\"%s\"", comma, &m_strings[entry.nameOffset],
+                               &m_strings[entry.valueOffset]);
+        }
+    }
+    if (err == ESP_OK)
+    {
+        err = appendFormat(out, size, &used, "}");
+    }
+    *length = used;
+    return err;
+}
+
+esp_err_t MetricsSnapshot::toStatsd(const char * prefix, const char * deviceId, char * out, size_t size, size_t * length) const
+{
+    size_t used = 0;
+    if (size == 0)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    out[0] = '\0';
+
+    // StatsD gauges only carry numbers, the device is identified by the metric name instead
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < m_entryCount && err == ESP_OK; i++)
+    {
+        const Entry & entry = m_entries[i];
+        if (entry.valueOffset == STRING_VALUE_NONE)
+        {
+            err = appendFormat(out, size, &used, "%s.%s.%s:%d|g\n", prefix, deviceId, &m_strings[entry.nameOffset],
+                               (int) entry.value);
+        }
+    }
+    *length = used;
+    return err;
+}
+
+esp_err_t MetricsSnapshot::addString(const char * str, uint16_t * offset)
+{
+    size_t length = strlen(str) + 1;
+    if (m_stringsUsed + length > sizeof(m_strings))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(&m_strings[m_stringsUsed], str, length);
+    *offset = (uint16_t) m_stringsUsed;
+    m_stringsUsed += length;
+    return ESP_OK;
+}
+
+size_t MetricsSnapshot::jsonLengthWith(size_t entryLength) const
+{
+    return m_jsonLength + entryLength + ((m_entryCount > 0) ? 1 : 0);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+// Core the sender and sink tasks run on
+#if CONFIG_M_M_TASK_PIN_TO_CORE
+#define M_M_TASK_CORE_ID CONFIG_M_M_TASK_CORE_ID
+#else
+#define M_M_TASK_CORE_ID tskNO_AFFINITY
+#endif
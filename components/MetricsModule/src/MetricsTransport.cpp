@@ -0,0 +1,43 @@
+#include "MetricsTransport.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+MetricsTransportStats MetricsTransport::stats() const
+{
+    portENTER_CRITICAL(&m_statsLock);
+    MetricsTransportStats stats = m_published;
+    portEXIT_CRITICAL(&m_statsLock);
+    return stats;
+}
+
+void MetricsTransport::publishStats()
+{
+    portENTER_CRITICAL(&m_statsLock);
+    m_published = m_stats;
+    portEXIT_CRITICAL(&m_statsLock);
+}
+
+esp_err_t MetricsTransport::parseUrl(const char * url, char * host, size_t hostSize, uint16_t * port)
+{
+    const char * hostStart = strstr(url, "://");
+    hostStart              = (hostStart == nullptr) ? url : hostStart + 3;
+    size_t hostLength      = strcspn(hostStart, ":/?");
+    if (hostLength == 0 || hostLength >= hostSize)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(host, hostStart, hostLength);
+    host[hostLength] = '\0';
+
+    if (hostStart[hostLength] == ':')
+    {
+        int portValue = atoi(hostStart + hostLength + 1);
+        if (portValue <= 0 || portValue > UINT16_MAX)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        *port = (uint16_t) portValue;
+    }
+    return ESP_OK;
+}
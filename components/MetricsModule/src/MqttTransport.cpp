@@ -0,0 +1,122 @@
+#include "MqttTransport.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+
+static const char * TAG = "MqttTransport";
+
+MqttTransport::MqttTransport(const char * brokerUri, const char * topic, int qos, size_t outboxLimit) :
+    m_brokerUri(brokerUri), m_topic(topic), m_qos(qos), m_outboxLimit(outboxLimit), m_client(nullptr), m_connected(false),
+    m_connectStartUs(0)
+{}
+
+MqttTransport::~MqttTransport()
+{
+    if (m_client != nullptr)
+    {
+        esp_mqtt_client_destroy(m_client);
+    }
+}
+
+esp_err_t MqttTransport::start(const char * clientId)
+{
+    if (m_client != nullptr)
+    {
+        ESP_LOGE(TAG, "MQTT client already started");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // A fixed client ID is required for the broker to keep the session across reconnects and reboots
+    char mqttClientId[48];
+    snprintf(mqttClientId, sizeof(mqttClientId), "metrics_%s", clientId);
+
+    esp_mqtt_client_config_t config      = {};
+    config.broker.address.uri            = m_brokerUri;
+    config.credentials.client_id         = mqttClientId;
+    config.session.disable_clean_session = true;
+    config.session.keepalive             = CONFIG_M_M_MQTT_KEEPALIVE;
+    config.network.timeout_ms            = CONFIG_M_M_HTTP_TIMEOUT_MS;
+    config.outbox.limit                  = m_outboxLimit;
+    m_client                             = esp_mqtt_client_init(&config);
+    if (m_client == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to initialize MQTT client");
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = esp_mqtt_client_register_event(m_client, MQTT_EVENT_ANY, &MqttTransport::mqttEventHandler, this);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to register MQTT event handler: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    m_connectStartUs = esp_timer_get_time();
+    err              = esp_mqtt_client_start(m_client);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start MQTT client: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t MqttTransport::send(const char * payload, size_t length)
+{
+    if (m_client == nullptr)
+    {
+        ESP_LOGE(TAG, "MQTT client not started");
+        m_stats.sendFailures++;
+        return ESP_ERR_INVALID_STATE;
+    }
+    // QoS 1 and 2 messages are kept in the client outbox, up to its limit, until delivered or expired
+    if (m_qos == 0 && !m_connected)
+    {
+        ESP_LOGW(TAG, "MQTT session not connected");
+        m_stats.sendFailures++;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int64_t sendStartUs = esp_timer_get_time();
+    int msgId           = esp_mqtt_client_publish(m_client, m_topic, payload, (int) length, m_qos, 0);
+    m_stats.sendUs      = esp_timer_get_time() - sendStartUs;
+    if (msgId == -2)
+    {
+        ESP_LOGW(TAG, "MQTT outbox full, dropping metrics for %s", m_topic);
+        m_stats.sendFailures++;
+        return ESP_ERR_NO_MEM;
+    }
+    if (msgId < 0)
+    {
+        ESP_LOGE(TAG, "Failed to publish metrics to %s", m_topic);
+        m_stats.sendFailures++;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void MqttTransport::mqttEventHandler(void * arg, esp_event_base_t eventBase, int32_t eventId, void * eventData)
+{
+    MqttTransport * self = (MqttTransport *) arg;
+
+    switch ((esp_mqtt_event_id_t) eventId)
+    {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        self->m_connectStartUs = esp_timer_get_time();
+        break;
+    case MQTT_EVENT_CONNECTED:
+        // The MQTT task updates the stats concurrently with the sink task publishing them
+        portENTER_CRITICAL(&self->m_statsLock);
+        self->m_stats.connectUs = esp_timer_get_time() - self->m_connectStartUs;
+        portEXIT_CRITICAL(&self->m_statsLock);
+        self->m_connected = true;
+        ESP_LOGI(TAG, "MQTT session connected");
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        self->m_connected = false;
+        ESP_LOGW(TAG, "MQTT session disconnected");
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,107 @@
+#include "UdpTransport.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char * TAG = "UdpTransport";
+#define STATSD_DEFAULT_PORT 8125
+
+UdpTransport::UdpTransport(const char * url) : m_url(url), m_socket(-1), m_destination(), m_destinationLength(0) {}
+
+UdpTransport::~UdpTransport()
+{
+    closeSocket();
+}
+
+esp_err_t UdpTransport::send(const char * payload, size_t length)
+{
+    if (m_socket < 0 && openSocket() != ESP_OK)
+    {
+        m_stats.sendFailures++;
+        return ESP_FAIL;
+    }
+
+    int64_t sendStartUs = esp_timer_get_time();
+    size_t start        = 0;
+    while (start < length)
+    {
+        // Packs as many whole lines as fit into one datagram so that none is fragmented by IP
+        size_t end = start;
+        while (end < length)
+        {
+            const char * newline = (const char *) memchr(payload + end, '\n', length - end);
+            size_t lineEnd       = (newline != nullptr) ? (size_t) (newline - payload) + 1 : length;
+            if (end > start && lineEnd - start > CONFIG_M_M_UDP_MAX_DATAGRAM)
+            {
+                break;
+            }
+            end = lineEnd;
+        }
+
+        int sent = sendto(m_socket, payload + start, end - start, 0, (struct sockaddr *) &m_destination, m_destinationLength);
+        if (sent < 0)
+        {
+            ESP_LOGE(TAG, "Failed to send datagram: errno %d", errno);
+            m_stats.sendUs = esp_timer_get_time() - sendStartUs;
+            m_stats.sendFailures++;
+            closeSocket();
+            return ESP_FAIL;
+        }
+        start = end;
+    }
+    m_stats.sendUs = esp_timer_get_time() - sendStartUs;
+    return ESP_OK;
+}
+
+esp_err_t UdpTransport::openSocket()
+{
+    char host[64];
+    uint16_t port = STATSD_DEFAULT_PORT;
+    if (parseUrl(m_url, host, sizeof(host), &port) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to parse UDP destination: %s", m_url);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char portStr[6];
+    snprintf(portStr, sizeof(portStr), "%u", (unsigned) port);
+
+    struct addrinfo hints = {};
+    hints.ai_family       = AF_UNSPEC;
+    hints.ai_socktype     = SOCK_DGRAM;
+    struct addrinfo * res = nullptr;
+
+    int64_t startUs = esp_timer_get_time();
+    int err         = getaddrinfo(host, portStr, &hints, &res);
+    m_stats.dnsUs   = esp_timer_get_time() - startUs;
+    if (err != 0 || res == nullptr)
+    {
+        ESP_LOGE(TAG, "Failed to resolve host: %s", host);
+        m_stats.dnsUs = -1;
+        return ESP_FAIL;
+    }
+
+    m_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (m_socket < 0)
+    {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        freeaddrinfo(res);
+        return ESP_FAIL;
+    }
+    memcpy(&m_destination, res->ai_addr, res->ai_addrlen);
+    m_destinationLength = res->ai_addrlen;
+    freeaddrinfo(res);
+    return ESP_OK;
+}
+
+void UdpTransport::closeSocket()
+{
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+}